@@ -5,13 +5,21 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <poll.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <setjmp.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
@@ -19,6 +27,7 @@
 #define MAX_FDS 28
 #define BUFFER_LEN 4096
 #define CONTROL_LEN (CMSG_LEN(MAX_FDS * sizeof(int32_t)))
+#define FD_QUEUE_LEN (4 * MAX_FDS)
 
 typedef enum {
     IDLE = 0, // Do not record or replay events
@@ -26,12 +35,118 @@ typedef enum {
     REPLAY = 2, // Replay recorded events
 } wap_mode_t;
 
+typedef enum {
+    WAP_OBJECT_WL_REGISTRY,
+    WAP_OBJECT_WL_SHM,
+    WAP_OBJECT_WL_COMPOSITOR,
+    WAP_OBJECT_WL_DATA_DEVICE_MANAGER,
+    WAP_OBJECT_WL_DATA_DEVICE,
+    WAP_OBJECT_WL_DATA_OFFER,
+    WAP_OBJECT_PRIMARY_SELECTION_DEVICE_MANAGER, // zwp_primary_selection_v1 and gtk_primary_selection
+    WAP_OBJECT_PRIMARY_SELECTION_DEVICE,
+    WAP_OBJECT_PRIMARY_SELECTION_OFFER,
+    WAP_OBJECT_LINUX_DMABUF,
+    WAP_OBJECT_LINUX_BUFFER_PARAMS,
+    WAP_OBJECT_DRM_SYNCOBJ_MANAGER,
+    WAP_OBJECT_WL_DRM,
+    WAP_OBJECT_COLOR_MANAGER,
+    WAP_OBJECT_ICC_CREATOR,
+    WAP_OBJECT_WP_VIEWPORTER,
+    WAP_OBJECT_WP_VIEWPORT,
+} wap_object_type_t;
+
+// Objects we only need to recognize by id: every wl_registry, every bound
+// wl_shm and wl_compositor, every object with requests that carry file descriptors, and
+// viewports, which change how surface coordinates map to the buffer
+typedef struct wap_object {
+    struct wap_object *next;
+    uint32_t id;
+    wap_object_type_t type;
+    uint32_t surface_id; // The wl_surface of a wp_viewport
+} wap_object_t;
+
+typedef struct wap_shm_pool {
+    struct wap_shm_pool *next;
+    uint32_t id;
+    int fd; // Our own dup of the fd passed with wl_shm.create_pool
+    const unsigned char *data;
+    size_t size;
+    int refs; // The wl_shm_pool object itself plus every buffer created from it
+} wap_shm_pool_t;
+
+typedef struct wap_shm_buffer {
+    struct wap_shm_buffer *next;
+    uint32_t id;
+    wap_shm_pool_t *pool;
+    int32_t offset;
+    int32_t width;
+    int32_t height;
+    int32_t stride;
+    uint32_t format;
+} wap_shm_buffer_t;
+
+typedef struct {
+    bool set;
+    int64_t x0;
+    int64_t y0;
+    int64_t x1;
+    int64_t y1;
+} wap_box_t;
+
+typedef struct wap_surface {
+    struct wap_surface *next;
+    uint32_t id;
+    bool attached; // A buffer has been attached since the last commit
+    uint32_t buffer_id;
+    int32_t scale;
+    int32_t transform;
+    int32_t pending_scale; // Applied on commit, like all other surface state
+    int32_t pending_transform;
+    bool viewport; // A wp_viewport source or destination is in effect
+    bool pending_viewport_source;
+    bool pending_viewport_destination;
+    wap_box_t surface_damage; // Pending damage in surface coordinates
+    wap_box_t buffer_damage; // Pending damage in buffer coordinates
+} wap_surface_t;
+
+typedef struct {
+    int log_fd; // frames.log, or -1 if frame hashing is disabled
+    bool disabled; // Set once we can no longer match file descriptors to requests
+    uint32_t frame_count;
+    int fd_queue[FD_QUEUE_LEN]; // Dups of received fds not yet claimed by a request
+    int fd_queue_head;
+    int fd_queue_len;
+    wap_object_t *objects;
+    wap_shm_pool_t *pools;
+    wap_shm_buffer_t *buffers;
+    wap_surface_t *surfaces;
+} wap_frames_t;
+
 volatile sig_atomic_t running = 1;
+volatile sig_atomic_t dump_requested = 0;
+
+// The client can truncate an shm pool at any time, which turns reads from our
+// mapping into SIGBUS. While reading pool memory we jump back out instead.
+static sigjmp_buf sigbus_jmp;
+static volatile sig_atomic_t sigbus_armed = 0;
 
 static void signal_handler(int signum) {
     if (signum == SIGINT || signum == SIGTERM) {
         running = 0;
+    } else if (signum == SIGUSR1) {
+        dump_requested = 1;
+    }
+}
+
+static void sigbus_handler(int signum) {
+    if (!sigbus_armed) {
+        // Not caused by reading a pool; let it crash as usual
+        signal(signum, SIG_DFL);
+        raise(signum);
+        return;
     }
+    sigbus_armed = 0;
+    siglongjmp(sigbus_jmp, 1);
 }
 
 static void timespec_sub(struct timespec *result, const struct timespec *a, const struct timespec *b) {
@@ -54,17 +169,946 @@ static bool timespec_leq(const struct timespec *a, const struct timespec *b) {
     }
 }
 
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME32 0x9E3779B1U
+
+#define HASH_STRIPE_LEN 64 // Bytes consumed by one hash_accumulate
+#define HASH_BLOCK_STRIPES 16 // Stripes between two hash_scramble
+
+// Frame hash in the style of XXH3: eight 64-bit accumulators each take the
+// product of the two 32-bit halves of a keyed input word, and are scrambled
+// after every block so that stripes cannot cancel out. That only needs 32x32
+// bit multiplies, which SSE2 provides. The SSE2 and scalar paths give the
+// same results.
+typedef struct {
+    uint64_t acc[8];
+    unsigned char buf[HASH_STRIPE_LEN]; // Partial stripe carried over between updates
+    size_t buf_len;
+    int stripe; // Stripes accumulated in the current block
+    uint64_t total_len;
+} wap_hash_t;
+
+// Stripe n of a block is keyed with words n to n + 7, the scramble uses the last 8
+static uint64_t hash_secret[HASH_BLOCK_STRIPES + 16];
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+#ifdef __SSE2__
+static void hash_accumulate(uint64_t *acc, const unsigned char *data, const uint64_t *key) {
+    for (int i = 0; i < 4; i++) {
+        __m128i a = _mm_loadu_si128((const __m128i *)acc + i);
+        __m128i d = _mm_loadu_si128((const __m128i *)data + i);
+        __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)key + i));
+        __m128i product = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        a = _mm_add_epi64(a, _mm_add_epi64(product, swapped));
+        _mm_storeu_si128((__m128i *)acc + i, a);
+    }
+}
+
+static void hash_scramble(uint64_t *acc, const uint64_t *key) {
+    const __m128i prime = _mm_set1_epi32(HASH_PRIME32);
+    for (int i = 0; i < 4; i++) {
+        __m128i a = _mm_loadu_si128((const __m128i *)acc + i);
+        a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)key + i));
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+        a = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+        _mm_storeu_si128((__m128i *)acc + i, a);
+    }
+}
+#else
+static void hash_accumulate(uint64_t *acc, const unsigned char *data, const uint64_t *key) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t v;
+        memcpy(&v, data + 8 * i, sizeof(v));
+        uint64_t dk = v ^ key[i];
+        acc[i ^ 1] += v;
+        acc[i] += (dk & 0xFFFFFFFF) * (dk >> 32);
+    }
+}
+
+static void hash_scramble(uint64_t *acc, const uint64_t *key) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= key[i];
+        acc[i] = a * HASH_PRIME32;
+    }
+}
+#endif
+
+static void hash_stripe(wap_hash_t *hash, const unsigned char *data) {
+    hash_accumulate(hash->acc, data, hash_secret + hash->stripe);
+    if (++hash->stripe == HASH_BLOCK_STRIPES) {
+        hash_scramble(hash->acc, hash_secret + HASH_BLOCK_STRIPES + 8);
+        hash->stripe = 0;
+    }
+}
+
+static void hash_init(wap_hash_t *hash) {
+    // The key only needs to be fixed, so derive it with splitmix64
+    if (hash_secret[0] == 0) {
+        uint64_t x = 0;
+        for (size_t i = 0; i < sizeof(hash_secret) / sizeof(hash_secret[0]); i++) {
+            x += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            hash_secret[i] = z ^ (z >> 31);
+        }
+    }
+
+    memset(hash, 0, sizeof(*hash));
+    for (int i = 0; i < 8; i++) {
+        hash->acc[i] = (i + 1) * HASH_PRIME1;
+    }
+}
+
+static void hash_update(wap_hash_t *hash, const unsigned char *data, size_t len) {
+    hash->total_len += len;
+
+    if (hash->buf_len > 0) {
+        size_t n = HASH_STRIPE_LEN - hash->buf_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(hash->buf + hash->buf_len, data, n);
+        hash->buf_len += n;
+        data += n;
+        len -= n;
+
+        if (hash->buf_len < HASH_STRIPE_LEN) {
+            return;
+        }
+        hash_stripe(hash, hash->buf);
+        hash->buf_len = 0;
+    }
+
+    for (; len >= HASH_STRIPE_LEN; data += HASH_STRIPE_LEN, len -= HASH_STRIPE_LEN) {
+        hash_stripe(hash, data);
+    }
+
+    memcpy(hash->buf, data, len);
+    hash->buf_len = len;
+}
+
+static uint64_t hash_final(wap_hash_t *hash) {
+    // Zero padding is told apart by the length mixed in below
+    if (hash->buf_len > 0) {
+        memset(hash->buf + hash->buf_len, 0, HASH_STRIPE_LEN - hash->buf_len);
+        hash_stripe(hash, hash->buf);
+    }
+
+    uint64_t h = hash->total_len * HASH_PRIME1;
+    for (int i = 0; i < 8; i++) {
+        h = rotl64(h ^ (hash->acc[i] * HASH_PRIME2), 31) * HASH_PRIME1 + HASH_PRIME3;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Returns the number of bytes per pixel for the given wl_shm format, or 0 if
+// the format is not known. Only packed single-plane formats are listed.
+static int shm_format_bpp(uint32_t format) {
+    switch (format) {
+    case WL_SHM_FORMAT_ARGB8888:
+    case WL_SHM_FORMAT_XRGB8888:
+    case WL_SHM_FORMAT_ABGR8888:
+    case WL_SHM_FORMAT_XBGR8888:
+    case WL_SHM_FORMAT_RGBA8888:
+    case WL_SHM_FORMAT_RGBX8888:
+    case WL_SHM_FORMAT_BGRA8888:
+    case WL_SHM_FORMAT_BGRX8888:
+    case WL_SHM_FORMAT_ARGB2101010:
+    case WL_SHM_FORMAT_XRGB2101010:
+    case WL_SHM_FORMAT_ABGR2101010:
+    case WL_SHM_FORMAT_XBGR2101010:
+        return 4;
+    case WL_SHM_FORMAT_RGB888:
+    case WL_SHM_FORMAT_BGR888:
+        return 3;
+    case WL_SHM_FORMAT_RGB565:
+    case WL_SHM_FORMAT_BGR565:
+    case WL_SHM_FORMAT_ARGB4444:
+    case WL_SHM_FORMAT_XRGB4444:
+    case WL_SHM_FORMAT_ARGB1555:
+    case WL_SHM_FORMAT_XRGB1555:
+        return 2;
+    case WL_SHM_FORMAT_ABGR16161616F:
+    case WL_SHM_FORMAT_XBGR16161616F:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static wap_object_t *frames_find_object(wap_frames_t *frames, uint32_t id) {
+    for (wap_object_t *object = frames->objects; object != NULL; object = object->next) {
+        if (object->id == id) {
+            return object;
+        }
+    }
+    return NULL;
+}
+
+static wap_object_t *frames_add_object(wap_frames_t *frames, uint32_t id, wap_object_type_t type) {
+    // Ids are reused once the previous object has been deleted
+    wap_object_t *object = frames_find_object(frames, id);
+    if (object != NULL) {
+        object->type = type;
+        object->surface_id = 0;
+        return object;
+    }
+
+    object = calloc(1, sizeof(*object));
+    if (object == NULL) {
+        perror("calloc object");
+        return NULL;
+    }
+
+    object->id = id;
+    object->type = type;
+    object->next = frames->objects;
+    frames->objects = object;
+    return object;
+}
+
+static void frames_remove_object(wap_frames_t *frames, uint32_t id) {
+    for (wap_object_t **link = &frames->objects; *link != NULL; link = &(*link)->next) {
+        wap_object_t *object = *link;
+        if (object->id == id) {
+            *link = object->next;
+            free(object);
+            return;
+        }
+    }
+}
+
+static wap_shm_pool_t *frames_find_pool(wap_frames_t *frames, uint32_t id) {
+    for (wap_shm_pool_t *pool = frames->pools; pool != NULL; pool = pool->next) {
+        if (pool->id == id) {
+            return pool;
+        }
+    }
+    return NULL;
+}
+
+static wap_shm_buffer_t *frames_find_buffer(wap_frames_t *frames, uint32_t id) {
+    for (wap_shm_buffer_t *buffer = frames->buffers; buffer != NULL; buffer = buffer->next) {
+        if (buffer->id == id) {
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+static wap_surface_t *frames_find_surface(wap_frames_t *frames, uint32_t id) {
+    for (wap_surface_t *surface = frames->surfaces; surface != NULL; surface = surface->next) {
+        if (surface->id == id) {
+            return surface;
+        }
+    }
+    return NULL;
+}
+
+static void shm_pool_unref(wap_shm_pool_t *pool) {
+    if (--pool->refs > 0) {
+        return;
+    }
+    munmap((void *)pool->data, pool->size);
+    close(pool->fd);
+    free(pool);
+}
+
+// Handles wl_shm.create_pool. Takes ownership of fd, which is our own dup of
+// the one the client sent.
+static void frames_create_pool(wap_frames_t *frames, uint32_t id, int fd, int32_t size) {
+    struct stat st;
+    if (size <= 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < size) {
+        fprintf(stderr, "Not tracking shm pool %u: unexpected file descriptor\n", id);
+        close(fd);
+        return;
+    }
+
+    wap_shm_pool_t *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        perror("calloc shm pool");
+        close(fd);
+        return;
+    }
+
+    pool->fd = fd;
+    void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, pool->fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap shm pool");
+        close(pool->fd);
+        free(pool);
+        return;
+    }
+
+    pool->id = id;
+    pool->data = data;
+    pool->size = size;
+    pool->refs = 1;
+    pool->next = frames->pools;
+    frames->pools = pool;
+}
+
+static void frames_resize_pool(wap_shm_pool_t *pool, int32_t size) {
+    struct stat st;
+    if (size <= 0 || fstat(pool->fd, &st) < 0 || st.st_size < size) {
+        fprintf(stderr, "Invalid resize of shm pool %u\n", pool->id);
+        return;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, pool->fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap shm pool");
+        return;
+    }
+
+    munmap((void *)pool->data, pool->size);
+    pool->data = data;
+    pool->size = size;
+}
+
+static void frames_destroy_pool(wap_frames_t *frames, uint32_t id) {
+    for (wap_shm_pool_t **link = &frames->pools; *link != NULL; link = &(*link)->next) {
+        wap_shm_pool_t *pool = *link;
+        if (pool->id == id) {
+            *link = pool->next;
+            shm_pool_unref(pool);
+            return;
+        }
+    }
+}
+
+static void frames_create_buffer(wap_frames_t *frames, wap_shm_pool_t *pool, const uint32_t *p) {
+    wap_shm_buffer_t *buffer = calloc(1, sizeof(*buffer));
+    if (buffer == NULL) {
+        perror("calloc shm buffer");
+        return;
+    }
+
+    buffer->id = p[2];
+    buffer->offset = p[3];
+    buffer->width = p[4];
+    buffer->height = p[5];
+    buffer->stride = p[6];
+    buffer->format = p[7];
+    buffer->pool = pool;
+    pool->refs++;
+    buffer->next = frames->buffers;
+    frames->buffers = buffer;
+}
+
+static void frames_destroy_buffer(wap_frames_t *frames, uint32_t id) {
+    for (wap_shm_buffer_t **link = &frames->buffers; *link != NULL; link = &(*link)->next) {
+        wap_shm_buffer_t *buffer = *link;
+        if (buffer->id == id) {
+            *link = buffer->next;
+            shm_pool_unref(buffer->pool);
+            free(buffer);
+            return;
+        }
+    }
+}
+
+static void frames_create_surface(wap_frames_t *frames, uint32_t id) {
+    wap_surface_t *surface = calloc(1, sizeof(*surface));
+    if (surface == NULL) {
+        perror("calloc surface");
+        return;
+    }
+
+    surface->id = id;
+    surface->scale = 1;
+    surface->pending_scale = 1;
+    surface->next = frames->surfaces;
+    frames->surfaces = surface;
+}
+
+static void frames_destroy_surface(wap_frames_t *frames, uint32_t id) {
+    for (wap_surface_t **link = &frames->surfaces; *link != NULL; link = &(*link)->next) {
+        wap_surface_t *surface = *link;
+        if (surface->id == id) {
+            *link = surface->next;
+            free(surface);
+            return;
+        }
+    }
+}
+
+static void box_add(wap_box_t *box, int64_t x0, int64_t y0, int64_t x1, int64_t y1) {
+    if (x1 <= x0 || y1 <= y0) {
+        return;
+    }
+
+    if (!box->set) {
+        box->set = true;
+        box->x0 = x0;
+        box->y0 = y0;
+        box->x1 = x1;
+        box->y1 = y1;
+    } else {
+        box->x0 = x0 < box->x0 ? x0 : box->x0;
+        box->y0 = y0 < box->y0 ? y0 : box->y0;
+        box->x1 = x1 > box->x1 ? x1 : box->x1;
+        box->y1 = y1 > box->y1 ? y1 : box->y1;
+    }
+}
+
+// Hashes rows y0 to y1 of the pixel data at base, reading row_len bytes from
+// row_offset in each. Returns false if the memory disappeared under us.
+static bool hash_region(const unsigned char *base, int32_t stride, size_t row_offset, size_t row_len,
+        int64_t y0, int64_t y1, uint64_t *result) {
+    if (sigsetjmp(sigbus_jmp, 1) != 0) {
+        return false;
+    }
+    sigbus_armed = 1;
+
+    wap_hash_t hash;
+    hash_init(&hash);
+    if (row_len == (size_t)stride) {
+        // Whole rows are contiguous in memory
+        hash_update(&hash, base + y0 * stride, (y1 - y0) * stride);
+    } else {
+        for (int64_t y = y0; y < y1; y++) {
+            hash_update(&hash, base + y * stride + row_offset, row_len);
+        }
+    }
+    *result = hash_final(&hash);
+
+    sigbus_armed = 0;
+    return true;
+}
+
+// Hashes the damaged region of the buffer that was attached to the surface,
+// reading straight from the client's shm pool, and logs the result.
+static void frames_commit(wap_frames_t *frames, wap_surface_t *surface, const struct timespec *dt) {
+    // Surface damage is relative to the state being committed, so apply the
+    // pending scale and transform before converting it to buffer coordinates
+    surface->scale = surface->pending_scale;
+    surface->transform = surface->pending_transform;
+    surface->viewport = surface->pending_viewport_source || surface->pending_viewport_destination;
+
+    wap_box_t damage = surface->buffer_damage;
+    const wap_box_t *sd = &surface->surface_damage;
+    if (sd->set) {
+        if (surface->transform != 0 || surface->viewport) {
+            // We do not undo buffer transforms or viewports (which is also
+            // how fractional scaling is done), so damage everything
+            box_add(&damage, 0, 0, INT64_MAX, INT64_MAX);
+        } else {
+            // Clamp first so that scaling cannot overflow; anything outside
+            // the buffer is clipped away below anyway
+            int64_t x0 = sd->x0 > 0 ? sd->x0 : 0;
+            int64_t y0 = sd->y0 > 0 ? sd->y0 : 0;
+            int64_t x1 = sd->x1 < INT32_MAX ? sd->x1 : INT32_MAX;
+            int64_t y1 = sd->y1 < INT32_MAX ? sd->y1 : INT32_MAX;
+            box_add(&damage, x0 * surface->scale, y0 * surface->scale, x1 * surface->scale, y1 * surface->scale);
+        }
+    }
+
+    bool attached = surface->attached;
+    surface->attached = false;
+    surface->surface_damage.set = false;
+    surface->buffer_damage.set = false;
+
+    if (!attached || !damage.set || surface->buffer_id == 0) {
+        return;
+    }
+
+    wap_shm_buffer_t *buffer = frames_find_buffer(frames, surface->buffer_id);
+    if (buffer == NULL) {
+        return; // Not an shm buffer, or its pool is not tracked
+    }
+
+    if (buffer->offset < 0 || buffer->width <= 0 || buffer->height <= 0 || buffer->stride <= 0
+            || (int64_t)buffer->offset + (int64_t)buffer->stride * buffer->height > (int64_t)buffer->pool->size) {
+        fprintf(stderr, "Invalid shm buffer %u\n", buffer->id);
+        return;
+    }
+
+    int64_t x0 = damage.x0 > 0 ? damage.x0 : 0;
+    int64_t y0 = damage.y0 > 0 ? damage.y0 : 0;
+    int64_t x1 = damage.x1 < buffer->width ? damage.x1 : buffer->width;
+    int64_t y1 = damage.y1 < buffer->height ? damage.y1 : buffer->height;
+    if (x1 <= x0 || y1 <= y0) {
+        return;
+    }
+
+    // If we do not know the pixel size, hash the damaged rows in their entirety
+    size_t row_offset = 0;
+    size_t row_len = buffer->stride;
+    int bpp = shm_format_bpp(buffer->format);
+    if (bpp > 0 && (int64_t)buffer->width * bpp <= buffer->stride) {
+        row_offset = x0 * bpp;
+        row_len = (x1 - x0) * bpp;
+    }
+
+    const unsigned char *base = buffer->pool->data + buffer->offset;
+    uint64_t hash;
+    if (!hash_region(base, buffer->stride, row_offset, row_len, y0, y1, &hash)) {
+        fprintf(stderr, "Shm pool %u was truncated, skipping frame\n", buffer->pool->id);
+        return;
+    }
+
+    char dump_name[32] = "";
+    if (dump_requested) {
+        dump_requested = 0;
+
+        snprintf(dump_name, sizeof(dump_name), "frame-%u.raw", frames->frame_count);
+        int fd = open(dump_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror("open frame dump");
+            dump_name[0] = '\0';
+        } else {
+            size_t len = (size_t)buffer->stride * buffer->height;
+            if (write(fd, base, len) != (ssize_t)len) {
+                perror("write frame dump");
+            }
+            close(fd);
+        }
+    }
+
+    dprintf(frames->log_fd, "%ld.%09ld %u %u %dx%d %d 0x%08x %" PRId64 ",%" PRId64 " %" PRId64 "x%" PRId64 " %016" PRIx64 "%s%s\n",
+        (long)dt->tv_sec, dt->tv_nsec, surface->id, buffer->id,
+        buffer->width, buffer->height, buffer->stride, buffer->format,
+        x0, y0, x1 - x0, y1 - y0, hash,
+        dump_name[0] != '\0' ? " " : "", dump_name);
+
+    frames->frame_count++;
+}
+
+// Forgets everything we track and closes all queued file descriptors
+static void frames_reset(wap_frames_t *frames) {
+    while (frames->objects != NULL) {
+        frames_remove_object(frames, frames->objects->id);
+    }
+    while (frames->buffers != NULL) {
+        frames_destroy_buffer(frames, frames->buffers->id);
+    }
+    while (frames->pools != NULL) {
+        frames_destroy_pool(frames, frames->pools->id);
+    }
+    while (frames->surfaces != NULL) {
+        frames_destroy_surface(frames, frames->surfaces->id);
+    }
+    for (; frames->fd_queue_len > 0; frames->fd_queue_len--) {
+        close(frames->fd_queue[frames->fd_queue_head]);
+        frames->fd_queue_head = (frames->fd_queue_head + 1) % FD_QUEUE_LEN;
+    }
+}
+
+// Stops frame hashing for the rest of the session. Guessing which file
+// descriptor belongs to which pool would make us hash the wrong memory, so we
+// give up loudly instead.
+static void frames_disable(wap_frames_t *frames, const char *reason) {
+    if (frames->disabled) {
+        return;
+    }
+
+    fprintf(stderr, "Frame hashing disabled: %s\n", reason);
+    dprintf(frames->log_fd, "# Frame hashing disabled: %s\n", reason);
+    frames_reset(frames);
+    frames->disabled = true;
+}
+
+// Queues a dup of a file descriptor received from the client. libwayland may
+// send file descriptors before the bytes of the request that carries them, so
+// they are claimed in order by frames_take_fd as the requests arrive.
+static void frames_queue_fd(wap_frames_t *frames, int fd) {
+    if (frames->disabled) {
+        return;
+    }
+
+    if (frames->fd_queue_len == FD_QUEUE_LEN) {
+        frames_disable(frames, "too many unclaimed file descriptors");
+        return;
+    }
+
+    int dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dup_fd < 0) {
+        perror("fcntl dup");
+        frames_disable(frames, "could not duplicate file descriptor");
+        return;
+    }
+
+    frames->fd_queue[(frames->fd_queue_head + frames->fd_queue_len) % FD_QUEUE_LEN] = dup_fd;
+    frames->fd_queue_len++;
+}
+
+// Returns the file descriptor belonging to the current request, or -1
+static int frames_take_fd(wap_frames_t *frames) {
+    if (frames->fd_queue_len == 0) {
+        frames_disable(frames, "request without a matching file descriptor");
+        return -1;
+    }
+
+    int fd = frames->fd_queue[frames->fd_queue_head];
+    frames->fd_queue_head = (frames->fd_queue_head + 1) % FD_QUEUE_LEN;
+    frames->fd_queue_len--;
+    return fd;
+}
+
+// Claims and closes the file descriptor of a request we do not care about
+static void frames_skip_fd(wap_frames_t *frames) {
+    int fd = frames_take_fd(frames);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Globals whose requests, including those on objects created from them, never
+// carry file descriptors
+static const char *const fdless_interfaces[] = {
+    // Core and shells
+    "wl_subcompositor",
+    "wl_seat",
+    "wl_output",
+    "wl_shell",
+    "wl_fixes",
+    "xdg_wm_base",
+    "zxdg_shell_v6",
+    "zwlr_layer_shell_v1",
+
+    // xdg extensions
+    "zxdg_output_manager_v1",
+    "zxdg_decoration_manager_v1",
+    "zxdg_exporter_v1",
+    "zxdg_importer_v1",
+    "zxdg_exporter_v2",
+    "zxdg_importer_v2",
+    "xdg_activation_v1",
+    "xdg_wm_dialog_v1",
+    "xdg_toplevel_icon_manager_v1",
+    "xdg_toplevel_drag_manager_v1",
+    "xdg_toplevel_tag_manager_v1",
+    "xdg_system_bell_v1",
+    "xdg_session_manager_v1",
+    "xx_session_manager_v1",
+
+    // wp extensions
+    "wp_fractional_scale_manager_v1", // Works through wp_viewport, which we track
+    "wp_presentation",
+    "wp_cursor_shape_manager_v1",
+    "wp_single_pixel_buffer_manager_v1",
+    "wp_content_type_manager_v1",
+    "wp_tearing_control_manager_v1",
+    "wp_alpha_modifier_v1",
+    "wp_fifo_manager_v1",
+    "wp_commit_timing_manager_v1",
+    "wp_color_representation_manager_v1",
+    "wp_pointer_warp_v1",
+
+    // Input
+    "zwp_relative_pointer_manager_v1",
+    "zwp_pointer_constraints_v1",
+    "zwp_pointer_gestures_v1",
+    "zwp_tablet_manager_v2",
+    "zwp_text_input_manager_v1",
+    "zwp_text_input_manager_v2",
+    "zwp_text_input_manager_v3",
+    "zwp_input_timestamps_manager_v1",
+    "zwp_idle_inhibit_manager_v1",
+    "zwp_keyboard_shortcuts_inhibit_manager_v1",
+    "ext_idle_notifier_v1",
+
+    // Toolkit and desktop specific
+    "gtk_shell1",
+    "qt_windowmanager",
+    "qt_surface_extension",
+    "qt_text_input_method_manager_v1",
+    "zqt_key_v1",
+    "org_kde_kwin_server_decoration_manager",
+    "org_kde_kwin_server_decoration_palette_manager",
+    "org_kde_kwin_appmenu_manager",
+    "org_kde_kwin_blur_manager",
+    "org_kde_kwin_contrast_manager",
+    "org_kde_kwin_shadow_manager",
+    "org_kde_kwin_slide_manager",
+    "kde_output_order_v1",
+    "frog_color_management_factory_v1",
+};
+
+static void frames_bind(wap_frames_t *frames, const char *interface, uint32_t id) {
+    if (frames->disabled) {
+        return;
+    }
+
+    if (strcmp(interface, wl_shm_interface.name) == 0) {
+        frames_add_object(frames, id, WAP_OBJECT_WL_SHM);
+    } else if (strcmp(interface, wl_compositor_interface.name) == 0) {
+        frames_add_object(frames, id, WAP_OBJECT_WL_COMPOSITOR);
+    } else if (strcmp(interface, "wl_data_device_manager") == 0) {
+        frames_add_object(frames, id, WAP_OBJECT_WL_DATA_DEVICE_MANAGER);
+    } else if (strcmp(interface, "zwp_primary_selection_device_manager_v1") == 0
+            || strcmp(interface, "gtk_primary_selection_device_manager") == 0) {
+        frames_add_object(frames, id, WAP_OBJECT_PRIMARY_SELECTION_DEVICE_MANAGER);
+    } else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0) {
+        frames_add_object(frames, id, WAP_OBJECT_LINUX_DMABUF);
+    } else if (strcmp(interface, "wp_linux_drm_syncobj_manager_v1") == 0) {
+        frames_add_object(frames, id, WAP_OBJECT_DRM_SYNCOBJ_MANAGER);
+    } else if (strcmp(interface, "wl_drm") == 0) {
+        frames_add_object(frames, id, WAP_OBJECT_WL_DRM);
+    } else if (strcmp(interface, "wp_color_manager_v1") == 0) {
+        frames_add_object(frames, id, WAP_OBJECT_COLOR_MANAGER);
+    } else if (strcmp(interface, "wp_viewporter") == 0) {
+        frames_add_object(frames, id, WAP_OBJECT_WP_VIEWPORTER);
+    } else {
+        for (size_t i = 0; i < sizeof(fdless_interfaces) / sizeof(fdless_interfaces[0]); i++) {
+            if (strcmp(interface, fdless_interfaces[i]) == 0) {
+                return;
+            }
+        }
+
+        char reason[128];
+        snprintf(reason, sizeof(reason), "client bound unknown global %s", interface);
+        frames_disable(frames, reason);
+    }
+}
+
+// Handles requests on the objects we track. Every request that carries a file
+// descriptor must claim it here, or the queue gets out of step.
+static void frames_handle_request(wap_frames_t *frames, const uint32_t *p, const struct timespec *dt) {
+    uint32_t id = p[0];
+    uint16_t opcode = p[1] & 0xFFFF;
+    uint16_t size = p[1] >> 16;
+
+    if (frames->disabled) {
+        return;
+    }
+
+    if (id == 1) { // wl_display
+        // Libraries such as EGL and libdecor create registries of their own,
+        // and we need to see the binds made through every one of them
+        if (opcode == 1 && size >= 12) { // wl_display.get_registry
+            frames_add_object(frames, p[2], WAP_OBJECT_WL_REGISTRY);
+        }
+        return;
+    }
+
+    wap_object_t *object = frames_find_object(frames, id);
+    if (object != NULL) {
+        switch (object->type) {
+        case WAP_OBJECT_WL_REGISTRY:
+            if (opcode == 0 && size >= 16) { // wl_registry.bind
+                uint32_t interface_len = p[3];
+                const char *interface = (const char *)(p + 4);
+                uint32_t new_id_index = 4 + (interface_len + 3) / 4 + 1;
+                if (interface_len == 0 || interface_len > size || (new_id_index + 1) * 4 > size
+                        || interface[interface_len - 1] != '\0') {
+                    frames_disable(frames, "malformed wl_registry.bind");
+                    break;
+                }
+                frames_bind(frames, interface, p[new_id_index]);
+            }
+            break;
+        case WAP_OBJECT_WL_SHM:
+            if (opcode == 0 && size >= 16) { // wl_shm.create_pool
+                int fd = frames_take_fd(frames);
+                if (fd >= 0) {
+                    frames_create_pool(frames, p[2], fd, p[3]);
+                }
+            }
+            break;
+        case WAP_OBJECT_WL_COMPOSITOR:
+            if (opcode == 0 && size >= 12) { // wl_compositor.create_surface
+                frames_create_surface(frames, p[2]);
+            }
+            break;
+        case WAP_OBJECT_WL_DATA_DEVICE_MANAGER:
+            if (opcode == 1 && size >= 12) { // wl_data_device_manager.get_data_device
+                frames_add_object(frames, p[2], WAP_OBJECT_WL_DATA_DEVICE);
+            }
+            break;
+        case WAP_OBJECT_WL_DATA_OFFER:
+            if (opcode == 1) { // wl_data_offer.receive
+                frames_skip_fd(frames);
+            } else if (opcode == 2) { // wl_data_offer.destroy
+                frames_remove_object(frames, id);
+            }
+            break;
+        case WAP_OBJECT_PRIMARY_SELECTION_DEVICE_MANAGER:
+            if (opcode == 1 && size >= 12) { // *_primary_selection_device_manager.get_device
+                frames_add_object(frames, p[2], WAP_OBJECT_PRIMARY_SELECTION_DEVICE);
+            }
+            break;
+        case WAP_OBJECT_PRIMARY_SELECTION_OFFER:
+            if (opcode == 0) { // *_primary_selection_offer.receive
+                frames_skip_fd(frames);
+            } else if (opcode == 1) { // *_primary_selection_offer.destroy
+                frames_remove_object(frames, id);
+            }
+            break;
+        case WAP_OBJECT_LINUX_DMABUF:
+            if (opcode == 1 && size >= 12) { // zwp_linux_dmabuf_v1.create_params
+                frames_add_object(frames, p[2], WAP_OBJECT_LINUX_BUFFER_PARAMS);
+            }
+            break;
+        case WAP_OBJECT_LINUX_BUFFER_PARAMS:
+            if (opcode == 1) { // zwp_linux_buffer_params_v1.add
+                frames_skip_fd(frames);
+            }
+            break;
+        case WAP_OBJECT_DRM_SYNCOBJ_MANAGER:
+            if (opcode == 2) { // wp_linux_drm_syncobj_manager_v1.import_timeline
+                frames_skip_fd(frames);
+            }
+            break;
+        case WAP_OBJECT_WL_DRM:
+            if (opcode == 3) { // wl_drm.create_prime_buffer
+                frames_skip_fd(frames);
+            }
+            break;
+        case WAP_OBJECT_COLOR_MANAGER:
+            if (opcode == 4 && size >= 12) { // wp_color_manager_v1.create_icc_creator
+                frames_add_object(frames, p[2], WAP_OBJECT_ICC_CREATOR);
+            }
+            break;
+        case WAP_OBJECT_ICC_CREATOR:
+            if (opcode == 0) { // wp_image_description_creator_icc_v1.create
+                frames_remove_object(frames, id); // Destroys the creator
+            } else if (opcode == 1) { // wp_image_description_creator_icc_v1.set_icc_file
+                frames_skip_fd(frames);
+            }
+            break;
+        case WAP_OBJECT_WP_VIEWPORTER:
+            if (opcode == 1 && size >= 16) { // wp_viewporter.get_viewport
+                wap_object_t *viewport = frames_add_object(frames, p[2], WAP_OBJECT_WP_VIEWPORT);
+                if (viewport != NULL) {
+                    viewport->surface_id = p[3];
+                }
+            }
+            break;
+        case WAP_OBJECT_WP_VIEWPORT: {
+            wap_surface_t *surface = frames_find_surface(frames, object->surface_id);
+            if (surface == NULL) {
+                break;
+            }
+            if (opcode == 0) { // wp_viewport.destroy
+                surface->pending_viewport_source = false;
+                surface->pending_viewport_destination = false;
+            } else if (opcode == 1 && size >= 24) { // wp_viewport.set_source
+                // All four set to wl_fixed_t -1.0 unsets the source
+                surface->pending_viewport_source = !(p[2] == 0xFFFFFF00 && p[3] == 0xFFFFFF00
+                    && p[4] == 0xFFFFFF00 && p[5] == 0xFFFFFF00);
+            } else if (opcode == 2 && size >= 16) { // wp_viewport.set_destination
+                surface->pending_viewport_destination = !((int32_t)p[2] == -1 && (int32_t)p[3] == -1);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        return;
+    }
+
+    wap_shm_pool_t *pool = frames_find_pool(frames, id);
+    if (pool != NULL) { // wl_shm_pool
+        if (opcode == 0 && size >= 32) { // wl_shm_pool.create_buffer
+            frames_create_buffer(frames, pool, p);
+        } else if (opcode == 1) { // wl_shm_pool.destroy
+            frames_destroy_pool(frames, id);
+        } else if (opcode == 2 && size >= 12) { // wl_shm_pool.resize
+            frames_resize_pool(pool, p[2]);
+        }
+        return;
+    }
+
+    if (frames_find_buffer(frames, id) != NULL) { // wl_buffer
+        if (opcode == 0) { // wl_buffer.destroy
+            frames_destroy_buffer(frames, id);
+        }
+        return;
+    }
+
+    wap_surface_t *surface = frames_find_surface(frames, id);
+    if (surface != NULL) { // wl_surface
+        if (opcode == 0) { // wl_surface.destroy
+            frames_destroy_surface(frames, id);
+        } else if (opcode == 1 && size >= 20) { // wl_surface.attach
+            surface->attached = true;
+            surface->buffer_id = p[2];
+        } else if (opcode == 2 && size >= 24) { // wl_surface.damage
+            int32_t x = p[2], y = p[3], w = p[4], h = p[5];
+            box_add(&surface->surface_damage, x, y, (int64_t)x + w, (int64_t)y + h);
+        } else if (opcode == 6) { // wl_surface.commit
+            frames_commit(frames, surface, dt);
+        } else if (opcode == 7 && size >= 12) { // wl_surface.set_buffer_transform
+            surface->pending_transform = p[2];
+        } else if (opcode == 8 && size >= 12) { // wl_surface.set_buffer_scale
+            surface->pending_scale = (int32_t)p[2] > 0 ? (int32_t)p[2] : 1;
+        } else if (opcode == 9 && size >= 24) { // wl_surface.damage_buffer
+            int32_t x = p[2], y = p[3], w = p[4], h = p[5];
+            box_add(&surface->buffer_damage, x, y, (int64_t)x + w, (int64_t)y + h);
+        }
+    }
+}
+
+// Handles events from the compositor that affect the objects we track
+static void frames_handle_event(wap_frames_t *frames, const uint32_t *p) {
+    uint32_t id = p[0];
+    uint16_t opcode = p[1] & 0xFFFF;
+    uint16_t size = p[1] >> 16;
+
+    if (frames->disabled) {
+        return;
+    }
+
+    if (id == 1 && opcode == 1 && size >= 12) { // wl_display.delete_id
+        frames_remove_object(frames, p[2]);
+        return;
+    }
+
+    wap_object_t *object = frames_find_object(frames, id);
+    if (object != NULL && opcode == 0 && size >= 12) {
+        if (object->type == WAP_OBJECT_WL_DATA_DEVICE) { // wl_data_device.data_offer
+            frames_add_object(frames, p[2], WAP_OBJECT_WL_DATA_OFFER);
+        } else if (object->type == WAP_OBJECT_PRIMARY_SELECTION_DEVICE) { // *_primary_selection_device.data_offer
+            frames_add_object(frames, p[2], WAP_OBJECT_PRIMARY_SELECTION_OFFER);
+        }
+    }
+}
+
+static void frames_finish(wap_frames_t *frames) {
+    frames_reset(frames);
+    if (frames->log_fd >= 0) {
+        close(frames->log_fd);
+        frames->log_fd = -1;
+    }
+}
+
 static void print_usage(const char *progname) {
     fprintf(stderr, "Usage: %s [options] <command>\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -c          Capture events (default behavior)\n");
     fprintf(stderr, "  -r          Replay captured events\n");
+    fprintf(stderr, "  -f          Hash committed shm frames (SIGUSR1 dumps the next one)\n");
     fprintf(stderr, "  -h          Show this help message and exit\n");
 }
 
 int main(int argc, char *argv[]) {
     char in_buffer[BUFFER_LEN];
     char out_buffer[BUFFER_LEN];
+
+    // Requests from the client, starting with the bytes of a request that was
+    // split across reads. Those have already been forwarded, but are kept so
+    // that the request can be parsed once the rest arrives.
+    char request_buffer[BUFFER_LEN];
+    size_t request_partial_len = 0;
     char control[CONTROL_LEN];
 
     int client_fd = -1;
@@ -77,6 +1121,8 @@ int main(int argc, char *argv[]) {
     uint32_t wl_touch_id = 0;
 
     wap_mode_t mode = CAPTURE;
+    bool hash_frames = false;
+    wap_frames_t frames = {.log_fd = -1};
 
     int i = 1;
     for (; i < argc; i++) {
@@ -88,6 +1134,8 @@ int main(int argc, char *argv[]) {
                 mode = CAPTURE;
             } else if (argv[i][1] == 'r' && argv[i][2] == '\0') {
                 mode = REPLAY;
+            } else if (argv[i][1] == 'f' && argv[i][2] == '\0') {
+                hash_frames = true;
             } else if (argv[i][1] == 'h' && argv[i][2] == '\0') {
                 print_usage(argv[0]);
                 return EXIT_SUCCESS;
@@ -272,6 +1320,22 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (hash_frames) {
+        frames.log_fd = open("frames.log", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (frames.log_fd < 0) {
+            perror("open frame log");
+            if (log_fd >= 0) {
+                close(log_fd);
+            }
+            unlink(downstream_addr.sun_path);
+            close(server_fd);
+            return EXIT_FAILURE;
+        }
+
+        signal(SIGUSR1, signal_handler);
+        signal(SIGBUS, sigbus_handler);
+    }
+
     signal(SIGINT, signal_handler);
 
     struct timespec t0 = {0, 0}; // Initalize to silence compiler warnings
@@ -295,7 +1359,10 @@ int main(int argc, char *argv[]) {
         int nevents = ppoll(fds, nfds, timeout_ptr, NULL);
         if (nevents < 0) {
             if (errno == EINTR) {
-                break;
+                // SIGUSR1 only requests a frame dump; SIGINT clears running.
+                // The replay timeout is computed from t, so keep it current.
+                clock_gettime(CLOCK_MONOTONIC, &t);
+                continue;
             }
             perror("poll");
             ret = EXIT_FAILURE;
@@ -369,9 +1436,12 @@ int main(int argc, char *argv[]) {
 
         // Handle messages from the client (requests)
         if (fds[1].revents & POLLIN) {
+            struct timespec dt;
+            timespec_sub(&dt, &t, &t0);
+
             struct iovec iov = {
-                .iov_base = in_buffer,
-                .iov_len = sizeof(in_buffer)
+                .iov_base = request_buffer + request_partial_len,
+                .iov_len = sizeof(request_buffer) - request_partial_len
             };
             struct msghdr msg = {
                 .msg_iov = &iov,
@@ -395,12 +1465,51 @@ int main(int argc, char *argv[]) {
 
                 break;
             } else {
-                uint32_t *p = (uint32_t *)in_buffer;
-                uint32_t *end = (uint32_t *)(in_buffer + n);
-                while (p < end) {
+                // File descriptors arrive no later than the requests that
+                // carry them, so queue them before parsing the requests
+                if (hash_frames) {
+                    if (msg.msg_flags & MSG_CTRUNC) {
+                        frames_disable(&frames, "file descriptors were truncated");
+                    }
+
+                    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                            int *cmsg_fds = (int *)CMSG_DATA(cmsg);
+                            int ncmsg_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int32_t);
+                            for (int i = 0; i < ncmsg_fds; i++) {
+                                frames_queue_fd(&frames, cmsg_fds[i]);
+                            }
+                        }
+                    }
+                }
+
+                uint32_t *p = (uint32_t *)request_buffer;
+                char *end = request_buffer + request_partial_len + n;
+                while ((char *)p < end) {
+                    if (end - (char *)p < 8) {
+                        break; // Incomplete header, wait for the rest
+                    }
+
                     uint32_t id = p[0];
                     uint16_t opcode = p[1] & 0xFFFF;
                     uint16_t size = p[1] >> 16;
+                    if (size < 8 || size % 4 != 0 || size > sizeof(request_buffer)) {
+                        fprintf(stderr, "Invalid request size: %u\n", size);
+                        if (hash_frames) {
+                            frames_disable(&frames, "invalid request size");
+                        }
+                        p = (uint32_t *)end;
+                        break;
+                    }
+
+                    if ((char *)p + size > end) {
+                        break; // Incomplete request, wait for the rest
+                    }
+
+                    if (hash_frames) {
+                        frames_handle_request(&frames, p, &dt);
+                    }
+
                     if (id == 1) { // wl_display
                         if (opcode == 1) { // wl_display.get_registry
                             wl_registry_id = p[2];
@@ -453,6 +1562,12 @@ int main(int argc, char *argv[]) {
                         }
                     }
                 }
+
+                // Keep the start of an incomplete request until the rest
+                // arrives. This must wait until the data has been forwarded,
+                // as the move may overwrite it.
+                request_partial_len = end - (char *)p;
+                memmove(request_buffer, p, request_partial_len);
             }
         }
 
@@ -505,6 +1620,10 @@ int main(int argc, char *argv[]) {
                     uint32_t id = p[0];
                     uint16_t opcode = p[1] & 0xFFFF;
                     uint16_t size = p[1] >> 16;
+                    if (hash_frames) {
+                        frames_handle_event(&frames, p);
+                    }
+
                     if (id == wl_pointer_id) { // wl_pointer
                         if (mode == CAPTURE) {
                             write(log_fd, &dt, sizeof(dt));
@@ -646,6 +1765,8 @@ int main(int argc, char *argv[]) {
 
     cleanup:
 
+    frames_finish(&frames);
+
     if (log_fd >= 0) {
         close(log_fd);
     }